@@ -289,6 +289,22 @@ struct lemon{
     memory_error(); \
 } ///< 内存申请错误检查
 
+/* 内存分配 */
+/// \brief 内存所属的子系统标签,用来分类统计内存的使用情况
+enum mem_tag{
+    MEM_OPTION, ///< 命令行选项(选项索引、-D宏、-T模板名)
+    MEM_PARSE,  ///< 语法文件缓存
+    MEM_STRING, ///< 字符串常量池(Strsafe和x1a表)
+    MEM_SYMBOL, ///< 符号(Symbol_new、x2a表以及排序用的符号数组)
+    MEM_STATE,  ///< 状态表(x3a表)
+    MEM_NTAG    ///< 子系统数量
+};
+void* lemon_malloc(enum mem_tag,size_t);
+void* lemon_calloc(enum mem_tag,size_t,size_t);
+void* lemon_realloc(enum mem_tag,void*,size_t);
+void lemon_free(void*);
+void MemStats_print(FILE*);
+
 /* 处理字符串的函数 */
 const char* Strsafe(const char*);
 void Strsafe_init(void);
@@ -304,6 +320,7 @@ struct symbol* Symbol_find(const char*);
 struct symbol* Symbol_Nth(int);
 int Symbol_count(void);
 struct symbol** Symbol_arrayof(void);
+void Symbol_sort(struct symbol**,int);
 
 /* 管理状态表的函数 */
 int Configcmp(const char*, const char*);
@@ -340,16 +357,216 @@ void ErrorMsg(const char *filename,int lineno,const char *format, ... ){
 
 
 /* main主程序部分 */
+static int memBudget=0;         ///< 内存上限(KB),0代表不限制,由选项-M<integer>或M=<integer>设置
+static int memBudgetExceeded=0; ///< 有内存申请因为超出上限而失败时设为1
+
 /**
  * @brief 内存空间申请失败的错误提示处理
  */
 void memory_error(void){
+    if (memBudgetExceeded){ // 因为超出内存上限而失败,打印各子系统的内存使用情况方便定位
+        fprintf(stderr,"Memory budget of %d KB exceeded.\n",memBudget);
+        MemStats_print(stderr);
+    }
     fprintf(stderr,"Out of memory. Aborting...\n");
     exit(1);
 }
 
+/// \brief 每一块内存前面附加的头部,记录这块内存的大小和所属子系统
+typedef union mem_header{
+    struct{
+        size_t size;      ///< 用户申请的字节数
+        enum mem_tag tag; ///< 所属子系统
+    } h;
+    long double align;    ///< 让头部的大小满足最严格的对齐要求,保证头部后面的用户内存正确对齐
+    void *p;
+} mem_header;
+
+/// \brief 单个子系统的内存统计
+struct mem_stat{
+    size_t live;  ///< 当前占用的字节数
+    size_t peak;  ///< 占用字节数的峰值
+    long nalloc;  ///< 申请次数(realloc也算一次)
+    long nfree;   ///< 释放次数
+};
+static struct mem_stat memStats[MEM_NTAG];  ///< 各子系统的内存统计
+static struct mem_stat memTotal;            ///< 所有子系统合计
+static const char *memTagName[MEM_NTAG]={
+    "option","parse","string","symbol","state"
+}; ///< 各子系统的名称,与enum mem_tag一一对应
+
+/**
+ * @brief 记录一次内存占用的变化
+ * @param tag 所属子系统
+ * @param oldsize 原来占用的字节数(新申请为0)
+ * @param newsize 现在占用的字节数(释放为0)
+ */
+static void mem_account(enum mem_tag tag,size_t oldsize,size_t newsize){
+    struct mem_stat *st=&memStats[tag];
+    st->live=st->live-oldsize+newsize;
+    memTotal.live=memTotal.live-oldsize+newsize;
+    if (newsize){
+        st->nalloc++;
+        memTotal.nalloc++;
+    }else{
+        st->nfree++;
+        memTotal.nfree++;
+    }
+    if (st->live>st->peak) st->peak=st->live;
+    if (memTotal.live>memTotal.peak) memTotal.peak=memTotal.live;
+}
+
+/**
+ * @brief 检查把一块oldsize字节的内存变成newsize字节后是否超出内存上限.
+ * 超出上限时直接通过memory_error()打印各子系统的内存使用情况并退出,
+ * 因为有些调用者(比如Strsafe_init())申请失败后会悄悄地继续运行.
+ */
+static void mem_check_budget(size_t oldsize,size_t newsize){
+    if (memBudget>0 && memTotal.live-oldsize+newsize>(size_t)memBudget*1024){
+        memBudgetExceeded=1;
+        memory_error();
+    }
+}
+
+/**
+ * @brief 带子系统标签的realloc(),lemon所有的内存申请都经过这里以便统计
+ * @param tag 所属子系统
+ * @param p 原来的内存(必须由lemon_malloc()/lemon_calloc()/lemon_realloc()申请),为空指针时相当于lemon_malloc()
+ * @param size 新的字节数
+ * @return 新的内存地址,失败返回空指针,此时原来的内存保持不变;超出内存上限时不返回,直接退出程序
+ */
+void* lemon_realloc(enum mem_tag tag,void *p,size_t size){
+    mem_header *hp=p?((mem_header*)p)-1:0;
+    size_t oldsize=hp?hp->h.size:0;
+    if (size>(size_t)-1-sizeof(mem_header)) return 0;
+    mem_check_budget(oldsize,size);
+    hp=(mem_header*)realloc(hp, sizeof(mem_header)+size);
+    if (hp==0) return 0;
+    if (p && hp->h.tag!=tag){ // 内存换了子系统,把原来的占用从旧的子系统转移过来
+        memStats[hp->h.tag].live-=oldsize;
+        memStats[tag].live+=oldsize;
+    }
+    hp->h.size=size;
+    hp->h.tag=tag;
+    mem_account(tag,oldsize,size);
+    return hp+1;
+}
+
+/**
+ * @brief 带子系统标签的malloc()
+ * @param tag 所属子系统
+ * @param size 字节数
+ * @return 内存地址,失败返回空指针
+ */
+void* lemon_malloc(enum mem_tag tag,size_t size){
+    return lemon_realloc(tag,0,size);
+}
+
+/**
+ * @brief 带子系统标签的calloc(),申请的内存全部清零
+ * @param tag 所属子系统
+ * @param n 元素个数
+ * @param size 每个元素的字节数
+ * @return 内存地址,失败返回空指针
+ */
+void* lemon_calloc(enum mem_tag tag,size_t n,size_t size){
+    void *p;
+    if (size && n>((size_t)-1)/size) return 0; // n*size溢出
+    p=lemon_realloc(tag,0,n*size);
+    if (p) memset(p,0,n*size);
+    return p;
+}
+
+/**
+ * @brief 释放由lemon_malloc()/lemon_calloc()/lemon_realloc()申请的内存
+ * @param p 内存地址,可以是空指针
+ */
+void lemon_free(void *p){
+    mem_header *hp;
+    if (p==0) return;
+    hp=((mem_header*)p)-1;
+    mem_account(hp->h.tag,hp->h.size,0);
+    free(hp);
+}
+
+/**
+ * @brief 打印各子系统的内存使用情况(当前占用、峰值、申请和释放次数)
+ * @param out 输出流
+ */
+void MemStats_print(FILE *out){
+    int i;
+    fprintf(out,"Memory usage by subsystem:\n");
+    fprintf(out,"  %-8s %12s %12s %10s %10s\n","","live","peak","allocs","frees");
+    for (i=0;i<MEM_NTAG;i++){
+        if (memStats[i].nalloc==0) continue;
+        fprintf(out,"  %-8s %12lu %12lu %10ld %10ld\n",memTagName[i],
+                (unsigned long)memStats[i].live,(unsigned long)memStats[i].peak,
+                memStats[i].nalloc,memStats[i].nfree);
+    }
+    fprintf(out,"  %-8s %12lu %12lu %10ld %10ld\n","total",
+            (unsigned long)memTotal.live,(unsigned long)memTotal.peak,
+            memTotal.nalloc,memTotal.nfree);
+}
+
 static int nDefine = 0;     ///< 选项D=..指定的宏的数目
+static int nDefineAlloc = 0;///< azDefine[]已经申请的容量,按两倍扩容
 static char** azDefine = 0; ///< 储存选项D=..指定的宏名称
+static int defineHtSize = 0;///< 宏名称哈希表的容量,必须是2的指数幂
+static int* defineHt = 0;   ///< 宏名称哈希表,储存azDefine[]下标加1(0代表空),冲突用defineNext[]串成链表
+static int* defineNext = 0; ///< defineNext[i]储存与azDefine[i]哈希值相同的下一个宏的下标加1
+
+/**
+ * @brief 计算字符串z前n个字符的哈希值,算法与strhash()相同,只是不要求字符串以'\0'结尾,
+ * 这样预处理时可以直接对语法文件缓存里的宏名称求哈希,而不用先拷贝出来.
+ * @param z 字符串
+ * @param n 字符个数
+ * @return 哈希值
+ */
+static unsigned strnhash(const char*z,int n){
+    unsigned h=0;
+    while (n-->0) h=h*13+*(z++);
+    return h;
+}
+
+/**
+ * @brief 在选项D=..定义的宏里查找名称为z前n个字符的宏
+ * @param z 宏名称(不要求以'\0'结尾)
+ * @param n 宏名称的长度
+ * @return 如果宏已经定义返回1,否则返回0
+ */
+static int define_find(const char*z,int n){
+    int i;
+    if (defineHtSize==0) return 0;
+    for (i=defineHt[strnhash(z,n)&(defineHtSize-1)];i;i=defineNext[i-1]){
+        if (strncmp(azDefine[i-1],z,n)==0 && azDefine[i-1][n]==0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 把azDefine[]里下标为i的宏插入哈希表,哈希表满了(数量达到容量)就扩容为两倍并重新插入所有宏
+ * @param i 宏在azDefine[]里的下标
+ */
+static void define_insert(int i){
+    unsigned h;
+    if (i>=defineHtSize){
+        int j;
+        defineHtSize=defineHtSize?defineHtSize*2:64;
+        defineHt=(int*)lemon_realloc(MEM_OPTION,defineHt, sizeof(defineHt[0])*defineHtSize);
+        defineNext=(int*)lemon_realloc(MEM_OPTION,defineNext, sizeof(defineNext[0])*defineHtSize);
+        if (defineHt==0||defineNext==0) memory_error();
+        memset(defineHt,0, sizeof(defineHt[0])*defineHtSize);
+        for (j=0;j<i;j++){ // 容量变化后哈希值的范围也变了,重新插入已有的宏
+            h=strnhash(azDefine[j],lemonStrlen(azDefine[j]))&(defineHtSize-1);
+            defineNext[j]=defineHt[h];
+            defineHt[h]=j+1;
+        }
+    }
+    h=strnhash(azDefine[i],lemonStrlen(azDefine[i]))&(defineHtSize-1);
+    defineNext[i]=defineHt[h];
+    defineHt[h]=i+1;
+}
+
 /**
  * @brief 处理选项D的函数指针,该函数指针最后储存在选项D的附加参数arg里.
  * 该函数主要用来启用语法文件(以.y为后缀)里%ifdef和%ifndef定义的宏.
@@ -357,26 +574,27 @@ static char** azDefine = 0; ///< 储存选项D=..指定的宏名称
  */
 static void handle_D_option(char*z){
     char** paz;
-    nDefine++; // 每一个handle_D_option处理一个D=..指定的宏,因此函数开头就把nDefine++.
-    azDefine=(char**)realloc(azDefine, sizeof(azDefine[0])*nDefine);
-    // realloc(point,size)在不改变point指向的存储数据的情况下,把point指向的内存空间变成size大小.
-    // 如果size小于原来的内存空间大小,就会丢失末尾部分数据;
-    // 如果size大于原来的内存空间大小,就相当于给内存扩容,同时也不影响前面保留的数据.
-    if (azDefine==0){ // 扩容失败
-        fprintf(stderr,"out of memory\n");
-        exit(1);
+    int n;
+    for (n=0;z[n]&&z[n]!='=';n++){} // 只有'='前面的部分才是宏名称
+    if (define_find(z,n)) return;   // 重复定义的宏不需要再储存
+    if (nDefine>=nDefineAlloc){
+        // azDefine[]容量不足时按两倍扩容,避免每定义一个宏就realloc()一次.
+        // realloc(point,size)在不改变point指向的存储数据的情况下,把point指向的内存空间变成size大小.
+        nDefineAlloc=nDefineAlloc?nDefineAlloc*2:16;
+        azDefine=(char**)lemon_realloc(MEM_OPTION,azDefine, sizeof(azDefine[0])*nDefineAlloc);
+        if (azDefine==0){ // 扩容失败
+            memory_error();
+        }
     }
+    nDefine++;
     paz = &azDefine[nDefine-1];// paz存储azDefine[]最后一个元素的地址.注意paz是char**类型的.
-    *paz = (char*) malloc(lemonStrlen(z)+1);// 申请*paz指向的内存空间,大小为z的长度加1
+    *paz = (char*) lemon_malloc(MEM_OPTION,n+1);// 申请*paz指向的内存空间,大小为宏名称的长度加1
     if (*paz==0){ // 申请失败
-        fprintf(stderr,"out of memory\n");
-        exit(1);
+        memory_error();
     }
-    lemon_strcpy(*paz,z);
-
-    // 后面两步是把字符串*paz里面的'='改为'0'.
-    for (z=*paz;*z&&*z!='=';z++){}
-    *z=0;
+    memcpy(*paz,z,n);
+    (*paz)[n]=0;
+    define_insert(nDefine-1);
 }
 
 
@@ -387,7 +605,7 @@ static char* user_templatename = NULL; ///< 储存用户自己指定的语法模
  * @param z 用户指定的模板文件名
  */
 static void handle_T_option(char *z){
-    user_templatename=(char*)malloc(lemonStrlen(z)+1);//长度多加1,用来储存末尾的'\0'.
+    user_templatename=(char*)lemon_malloc(MEM_OPTION,lemonStrlen(z)+1);//长度多加1,用来储存末尾的'\0'.
     if (user_templatename==0){ // 申请空间失败
         memory_error();
     }
@@ -421,6 +639,7 @@ int main(int argc,char** argv){
             {OPT_FSTR, "f", 0, "Ignored.  (Placeholder for -f compiler options.)"},
             {OPT_FLAG, "g", (char*)&rpflag, "Print grammar without actions."},
             {OPT_FSTR, "I", 0, "Ignored.  (Placeholder for '-I' compiler options.)"},
+            {OPT_INT,  "M", (char*)&memBudget, "Memory budget in KB (0 means no limit)."},
             {OPT_FLAG, "m", (char*)&mhflag, "Output a makeheaders compatible file."},
             {OPT_FLAG, "l", (char*)&nolinenosflag, "Do not print #line statements."},
             {OPT_FSTR, "O", 0, "Ignored.  (Placeholder for '-O' compiler options.)"},
@@ -442,6 +661,7 @@ int main(int argc,char** argv){
     struct rule* rp;
 
     OptInit(argv,options,stderr);  // 初始化选项
+    mem_check_budget(0,0); // 内存上限要等所有选项处理完才检查,包括在M选项之前的选项(比如-D)申请的内存
 
     /*
      * 如果用户输入lemon -x,按照前面的处理过程,由于-x选项是OPT_FLAG类型,
@@ -481,6 +701,25 @@ int main(int argc,char** argv){
 
     /* 读取处理语法文件 */
     Parse(&lem); // 将前面处理的lem变量(已经储存文件名)作为参数交给Parse
+    if (lem.errorcnt) exit(lem.errorcnt);
+    lem.errsym=Symbol_find("error");
+
+    /* 统计符号数量并给符号编号 */
+    Symbol_new("{default}"); // "{default}"排在所有非终结符的最后,作为终结符/非终结符与MULTITERMINAL的分界
+    lem.nsymbol=Symbol_count();
+    lem.symbols=Symbol_arrayof();
+    MemoryCheck(lem.symbols);
+    Symbol_sort(lem.symbols,lem.nsymbol); // 排序的同时设置每个符号的index
+    i=lem.nsymbol;
+    while (lem.symbols[i-1]->type==MULTITERMINAL){ i--; }
+    assert(strcmp(lem.symbols[i-1]->name,"{default}")==0);
+    lem.nsymbol=i-1; // nsymbol不包括"{default}"以及MULTITERMINAL
+    for (i=1;ISUPPER(lem.symbols[i]->name[0]);i++){}
+    lem.nterminal=i; // "$"加上所有大写字母开头的终结符
+
+    if (statistics){ // 选项-s: 打印统计信息
+        MemStats_print(stdout);
+    }
 }
 
 //-----------------------所有函数的实现----------------
@@ -493,6 +732,29 @@ static FILE* errstream;   ///< 错误输出流
 
 static char emsg[]="Command line syntax error: "; ///< 错误提示字符串的开头
 
+static int nop;            ///< op[]中选项的数目(不包括末尾label为0的哨兵)
+static int opfirst[256];   ///< 以选项标签首字符为下标的索引表,储存op[]中第一个以该字符开头的选项下标加1(0代表没有)
+static int *opnext;        ///< opnext[j]储存op[]中与op[j]首字符相同的下一个选项下标加1(0代表链表结束)
+
+/**
+ * @brief 按选项标签的首字符给op[]建立索引,让handleflags()和handleswitch()不用每次都顺序扫描整个op[].
+ * @see 同一首字符的选项按照它们在op[]里的顺序串成链表(倒序遍历再用头插法),
+ * 这样沿链表匹配得到的第一个选项与原来从头扫描op[]得到的结果完全一样.
+ * lemon自带的选项标签都是单个字符,所以每条链表实际上只有一个节点,一次查表就能确定选项.
+ */
+static void optindex_init(void){
+    int j;
+    for (nop=0;op[nop].label;nop++){}
+    memset(opfirst,0, sizeof(opfirst));
+    opnext=(int*)lemon_realloc(MEM_OPTION,opnext, sizeof(opnext[0])*(nop+1));
+    MemoryCheck(opnext);
+    for (j=nop-1;j>=0;j--){
+        unsigned char c=(unsigned char)op[j].label[0];
+        opnext[j]=opfirst[c];
+        opfirst[c]=j+1;
+    }
+}
+
 /**
  * 在第n+1个(n从0开始)命令行参数的第k个字符下方标出出错的地方
  * @param n   命令行参数的索引下标
@@ -553,11 +815,11 @@ static int handleflags(int i,FILE*err) {
     int v;
     int errcnt = 0;  // 统计错误个数
     int j;
-    for (j = 0; op[j].label; j++) {
-        // 遍历lemon支持的选项数组,若找出一个与命令行参数的值匹配的就立即退出.
-        // 因此for循环退出后,若op[j].label不为0,则代表匹配成功.
+    for (j = opfirst[(unsigned char)argv[i][1]]-1; j>=0; j = opnext[j]-1) {
+        // 只遍历首字符与命令行参数相同的选项,若找出一个与命令行参数的值匹配的就立即退出.
         if (strncmp(&argv[i][1], op[j].label, lemonStrlen(op[j].label)) == 0) break;
     }
+    if (j<0) j=nop; // 匹配不成功时让j指向末尾的哨兵,因此op[j].label不为0就代表匹配成功.
     v=((argv[i][0]=='-')?1:0); // 若选项带"-"前缀则v为1,若前缀为"+"则v为0
     if (op[j].label==0){// 匹配不成功
         if (err){
@@ -581,6 +843,28 @@ static int handleflags(int i,FILE*err) {
         // 如果选项类型是OPT_FSTR,首先把选项附加的参数指针arg强制转换为
         // (void(*)(char*))类型的函数指针,然后传递&argv[i][2]调用这个函数指针指向的函数.
         (*(void(*)(char*))(op[j].arg))(&argv[i][2]);
+    }else if(op[j].type==OPT_INT||op[j].type==OPT_FINT){
+        // 形如"-M100"的写法:选项标签后面直接跟整数,与handleswitch()处理"M=100"一样提取并检查整数
+        char *cp=&argv[i][1+lemonStrlen(op[j].label)];
+        char *end;
+        int lv=strtol(cp,&end,0);
+        if (*cp==0){ // 标签后面没有整数
+            if (err){
+                fprintf(err,"%smissing argument on switch.\n",emsg);
+                errline(i,1,err);
+            }
+            errcnt++;
+        }else if (*end){ // 提取后*end不等于'\0'则错误
+            if (err){
+                fprintf(err,"%sillegal character in integer argument.\n",emsg);
+                errline(i,(int)(end-argv[i]),err);
+            }
+            errcnt++;
+        }else if (op[j].type==OPT_INT){
+            *(int*)(op[j].arg)=lv;
+        }else{
+            (*(void(*)(int))(op[j].arg))(lv);
+        }
     }else{
         if (err){
             fprintf(err,"%smissing argument on switch.\n",emsg);
@@ -616,9 +900,10 @@ static int handleswitch(int i,FILE *err){
     cp=strchr(argv[i],'='); // cp保存命令行参数中间'='的地址
     assert(cp!=0);
     *cp=0; // 改变命令行参数中间的'='为'0',中断命令行参数,这样后面的argv[i]就只保留前面的部分,才能与option的label进行比较.
-    for (j=0;op[j].label;j++){
+    for (j=opfirst[(unsigned char)argv[i][0]]-1;j>=0;j=opnext[j]-1){
         if (strcmp(argv[i],op[j].label)==0) break; // 找到匹配的选项,退出循环
     }
+    if (j<0) j=nop; // 同handleflags(),没有匹配就指向哨兵
     *cp='='; // 恢复命令行参数中间的'='
     if (op[j].label==0){ // 如果与lemon支持的选项不匹配,说明出错
         if (err){
@@ -705,6 +990,7 @@ int OptInit(char**a,struct s_options*o,FILE*err){
     argv=a;
     op=o;
     errstream=err;
+    if (op) optindex_init();
     if ( argv && *argv && op ){ // 满足argv,*argv和op不为空才能继续处理
         int i;
         for (i=1;argv[i];i++){ // 遍历用户的命令行参数,从argv[1]开始
@@ -874,12 +1160,183 @@ struct pstate{
 static void parseonetoken(struct pstate *psp){
 
 }
+/// \brief %if/%ifdef/%ifndef后面的布尔表达式求值时使用的游标
+struct pp_cursor{
+    const char *z;   ///< 当前读取的位置
+    const char *end; ///< 表达式的末尾(即指令所在行的行末)
+    int err;         ///< 表达式出现语法错误时设为1
+};
+
+static int pp_eval_or(struct pp_cursor *c);
+
 /**
- * @brief
+ * @brief 跳过表达式里的空白符
+ * @param c 表达式游标
+ */
+static void pp_skip_space(struct pp_cursor *c){
+    while (c->z<c->end && ISSPACE(*c->z)) c->z++;
+}
+
+/**
+ * @brief 求值一元表达式: '!'取反、括号括起的子表达式或者宏名称(已定义为1,否则为0)
+ * @param c 表达式游标
+ * @return 求值结果(0或1)
+ */
+static int pp_eval_unary(struct pp_cursor *c){
+    pp_skip_space(c);
+    if (c->z<c->end && *c->z=='!'){
+        c->z++;
+        return !pp_eval_unary(c);
+    }
+    if (c->z<c->end && *c->z=='('){
+        int v;
+        c->z++;
+        v=pp_eval_or(c);
+        pp_skip_space(c);
+        if (c->z<c->end && *c->z==')') c->z++;
+        else c->err=1; // 括号不匹配
+        return v;
+    }
+    if (c->z<c->end && (ISALPHA(*c->z)||*c->z=='_')){
+        const char *name=c->z;
+        while (c->z<c->end && (ISALNUM(*c->z)||*c->z=='_')) c->z++;
+        return define_find(name,(int)(c->z-name));
+    }
+    c->err=1;
+    return 0;
+}
+
+/**
+ * @brief 求值由"&&"连接的表达式,"&&"的优先级高于"||"
+ * @param c 表达式游标
+ * @return 求值结果(0或1)
+ */
+static int pp_eval_and(struct pp_cursor *c){
+    int v=pp_eval_unary(c);
+    for (;;){
+        pp_skip_space(c);
+        if (c->z+1>=c->end || c->z[0]!='&' || c->z[1]!='&') return v;
+        c->z+=2;
+        v=pp_eval_unary(c) && v; // 先求值右边,保证整个表达式都做了语法检查
+    }
+}
+
+/**
+ * @brief 求值由"||"连接的表达式
+ * @param c 表达式游标
+ * @return 求值结果(0或1)
+ */
+static int pp_eval_or(struct pp_cursor *c){
+    int v=pp_eval_and(c);
+    for (;;){
+        pp_skip_space(c);
+        if (c->z+1>=c->end || c->z[0]!='|' || c->z[1]!='|') return v;
+        c->z+=2;
+        v=pp_eval_and(c) || v;
+    }
+}
+
+/**
+ * @brief 计算缓存z里p所在的行号,只在报错时使用,所以预处理的主循环不需要逐字符统计行号
+ * @param z 语法文件缓存首地址
+ * @param p 缓存里的某个位置
+ * @return p所在的行号(从1开始)
+ */
+static int pp_lineno(const char *z,const char *p){
+    int lineno=1;
+    while ((z=(const char*)memchr(z,'\n',p-z))!=0){
+        lineno++;
+        z++;
+    }
+    return lineno;
+}
+
+/**
+ * @brief 把[start,end)范围内除换行符以外的字符全部替换为空格.
+ * 保留换行符是为了让后面的词法分析得到的行号与原文件一致.
+ * 这里按行用memset()整段填充,而不是逐个字符判断.
+ * @param start 范围起始地址
+ * @param end   范围结束地址(不包括)
+ */
+static void pp_blank(char *start,char *end){
+    char *nl;
+    while (start<end && (nl=(char*)memchr(start,'\n',end-start))!=0){
+        memset(start,' ',nl-start);
+        start=nl+1;
+    }
+    if (start<end) memset(start,' ',end-start);
+}
+
+/**
+ * @brief 预处理语法文件缓存,处理%ifdef/%ifndef/%if/%else/%endif条件编译指令.
+ * @see 指令必须位于行首.%ifdef和%if后面的表达式为真时保留后面的内容,%ifndef则相反;
+ * 表达式可以是宏名称以及用"!"、"&&"、"||"和括号组合起来的布尔表达式,宏由选项-D定义.
+ * 被排除的区域以及指令所在的行都替换为空格(保留换行符).
+ * 查找指令时用memchr()直接跳到下一个'%',只检查位于行首的'%',
+ * 被排除的区域等到遇到对应的%else/%endif时才用pp_blank()整段清除.
  * @param z 读入的语法文件缓存
  */
 static void preprocess_input(char *z){
-
+    char *end=z+strlen(z); // 缓存末尾的'\0'
+    char *cp=z;            // 当前搜索位置
+    char *start=0;         // 当前被排除区域的起始地址
+    int exclude=0;         // 当前嵌套在被排除区域里的层数,0代表没有被排除
+    while ((cp=(char*)memchr(cp,'%',end-cp))!=0){
+        char *eol;   // 指令所在行的行末('\n'或者缓存末尾)
+        if (cp>z && cp[-1]!='\n'){ // 不在行首的'%'不是预处理指令
+            cp++;
+            continue;
+        }
+        eol=(char*)memchr(cp,'\n',end-cp);
+        if (eol==0) eol=end;
+        if (strncmp(cp,"%endif",6)==0 && (ISSPACE(cp[6])||cp[6]==0)){
+            if (exclude){
+                exclude--;
+                if (exclude==0) pp_blank(start,cp);
+            }
+        }else if (strncmp(cp,"%else",5)==0 && (ISSPACE(cp[5])||cp[5]==0)){
+            if (exclude==1){
+                exclude=0;
+                pp_blank(start,cp);
+            }else if (exclude==0){
+                exclude=1;
+                start=cp;
+            }
+        }else if (strncmp(cp,"%ifdef ",7)==0
+                ||strncmp(cp,"%ifndef ",8)==0
+                ||strncmp(cp,"%if ",4)==0){
+            if (exclude){
+                exclude++; // 被排除区域里面嵌套的指令只需要记录层数
+            }else{
+                struct pp_cursor c;
+                int isNot=(cp[3]=='n'); // %ifndef
+                int v;
+                c.z=cp+(isNot?7:(cp[3]=='d'?6:3));
+                c.end=eol;
+                c.err=0;
+                v=pp_eval_or(&c);
+                pp_skip_space(&c);
+                if (c.err || c.z<c.end){
+                    fprintf(stderr,"%%if syntax error on line %d.\n",pp_lineno(z,cp));
+                    fprintf(stderr,"  %.*s <-- syntax error here\n",(int)(c.z<eol?c.z-cp+1:eol-cp),cp);
+                    exit(1);
+                }
+                if (isNot?v:!v){
+                    exclude=1;
+                    start=cp;
+                }
+            }
+        }else{
+            cp++; // 其他的%指令(比如%include)留给词法分析处理
+            continue;
+        }
+        pp_blank(cp,eol); // 清除指令所在的行
+        cp=eol;
+    }
+    if (exclude){
+        fprintf(stderr,"unterminated %%ifdef starting on line %d\n",pp_lineno(z,start));
+        exit(1);
+    }
 }
 /**
  * @brief 词法分析函数,用来读取并处理整一个语法文件
@@ -919,7 +1376,7 @@ void Parse(struct lemon* gp){
     // 确定了这个位置后调用ftell(FILE*)可以精确得到文件大小(对于二进制文件就是文件的字节数目)
     filesize=ftell(fp);// 得到二进制文件的字节数大小(因为语法文件仅有ASCII字符,所以字节数等同于文件大小,如果是其他编码文件就不一定了)
     rewind(fp);// 恢复文件内部的位置指针的位置
-    filebuf=(char*)malloc(filesize+1); // 申请文件缓存(+1是提供一个'\0')
+    filebuf=(char*)lemon_malloc(MEM_PARSE,filesize+1); // 申请文件缓存(+1是提供一个'\0')
     if (filesize>100000000||filebuf==0){
         ErrorMsg(ps.filename,0,"Input file too large.");
         gp->errorcnt++;
@@ -929,7 +1386,7 @@ void Parse(struct lemon* gp){
     if (fread(filebuf,1,filesize,fp)!=filesize){//读取到缓存失败
         ErrorMsg(ps.filename,0,"Can't read in all %d bytes of this file.",
           filesize);
-        free(filebuf); // 释放缓存
+        lemon_free(filebuf); // 释放缓存
         gp->errorcnt++;
         fclose(fp);
         return;
@@ -966,7 +1423,7 @@ const char* Strsafe(const char*y){
     char *cpy; // 用来复制y的值
     if (y==0) return 0; // 空指针无需创建
     z=Strsafe_find(y);  // 在字符串常量池(x1a->ht[])里搜索是否存在与*y相同的字符串,如果存在(z不为空指针)则跳过下面的if,直接返回z.
-    if (z==0 &&(cpy=(char*)malloc(lemonStrlen(y)+1))!=0){ // 满足两个条件:搜索后z为空指针;申请cpy的空间成功,才能继续往字符串常量池插入z
+    if (z==0 &&(cpy=(char*)lemon_malloc(MEM_STRING,lemonStrlen(y)+1))!=0){ // 满足两个条件:搜索后z为空指针;申请cpy的空间成功,才能继续往字符串常量池插入z
         lemon_strcpy(cpy,y);
         z=cpy;
         Strsafe_insert(z);
@@ -1005,13 +1462,13 @@ static struct s_x1 * x1a; ///< 全局的s_x1结构体实例
  */
 void Strsafe_init(void){
     if(x1a) return; // 只初始化内存一次
-    x1a=(struct s_x1*)malloc(sizeof(struct s_x1));
+    x1a=(struct s_x1*)lemon_malloc(MEM_STRING,sizeof(struct s_x1));
     if (x1a){
         x1a->size=1024; // 必须是2的指数幂
         x1a->count=0;   // 当前实际数据数量为0
-        x1a->tbl=(x1node*)calloc(1024, sizeof(x1node)+ sizeof(x1node*));
+        x1a->tbl=(x1node*)lemon_calloc(MEM_STRING,1024, sizeof(x1node)+ sizeof(x1node*));
         if (x1a->tbl==0){ // tbl申请空间失败
-            free(x1a); // 释放x1a已经占有的空间
+            lemon_free(x1a); // 释放x1a已经占有的空间
             x1a=0;     // 将x1a设置为空指针,避免x1a变成野指针
         }else{
             int i;
@@ -1047,7 +1504,7 @@ int Strsafe_insert(const char *data){
         struct s_x1 array;
         array.size=arrSize=x1a->size*2;
         array.count=x1a->count;
-        array.tbl=(x1node*)calloc(arrSize, sizeof(x1node)+ sizeof(x1node*));
+        array.tbl=(x1node*)lemon_calloc(MEM_STRING,arrSize, sizeof(x1node)+ sizeof(x1node*));
         if (array.tbl==0) return 0;
         array.ht=(x1node**)&(array.tbl[arrSize]);
         for (i=0;i<arrSize;i++) array.ht[i]=0;
@@ -1062,7 +1519,7 @@ int Strsafe_insert(const char *data){
             newnp->from=&(array.ht[h]);
             array.ht[h]=newnp;
         }
-        free(x1a->tbl);
+        lemon_free(x1a->tbl);
         *x1a=array;
     }
     h=ph&(x1a->size-1);
@@ -1117,13 +1574,13 @@ struct s_x2 *x2a; ///< 全局的s_x2实例
  */
 void Symbol_init(void){
     if (x2a) return;
-    x2a=(struct s_x2*)malloc(sizeof(struct s_x2));
+    x2a=(struct s_x2*)lemon_malloc(MEM_SYMBOL,sizeof(struct s_x2));
     if (x2a){
         x2a->size=128;
         x2a->count=0;
-        x2a->tbl=(x2node*)calloc(128, sizeof(x2node)+ sizeof(x2node*));
+        x2a->tbl=(x2node*)lemon_calloc(MEM_SYMBOL,128, sizeof(x2node)+ sizeof(x2node*));
         if (x2a->tbl==0){
-            free(x2a);
+            lemon_free(x2a);
             x2a=0;
         }else{
             int i;
@@ -1173,7 +1630,7 @@ int Symbol_insert(struct symbol *data,const char *key){
         struct s_x2 array; // 开辟新的s_x2实例
         array.size=arrSize=x2a->size*2; // 容量扩大两倍
         array.count=x2a->count; // 数量保持不变
-        array.tbl=(x2node*)calloc(arrSize, sizeof(x2node)+ sizeof(x2node*));//申请新的tbl内存
+        array.tbl=(x2node*)lemon_calloc(MEM_SYMBOL,arrSize, sizeof(x2node)+ sizeof(x2node*));//申请新的tbl内存
         if (array.tbl==0) return 0; // 申请tbl[]失败
         array.ht=(x2node**)&(array.tbl[arrSize]); // 初始化哈希表首地址
         for (i=0; i<arrSize; i++){
@@ -1202,7 +1659,7 @@ int Symbol_insert(struct symbol *data,const char *key){
             array.ht[h]=newnp;
         }
         // 注意的是tbl[]与ht[]是连在一起的一整块内存,而x2a->tbl是这整一块内存的首地址,所以free(x2a->tbl)等同于同时释放tbl[]和ht[].
-        free(x2a->tbl);
+        lemon_free(x2a->tbl);
         *x2a=array; // 让x2a指向array的内存空间.这样x2a依然能够代表s_x2唯一实例的地址.
     }
 
@@ -1225,7 +1682,7 @@ int Symbol_insert(struct symbol *data,const char *key){
 struct symbol* Symbol_new(const char*x){
     struct symbol *sp=Symbol_find(x); // 查找键值为x的符号是否已经存在
     if (sp==0){ // 如果符号还不存在,就可以安装这个符号
-        sp=(struct symbol*)calloc(1,sizeof(struct symbol));//申请内存块并清零
+        sp=(struct symbol*)lemon_calloc(MEM_SYMBOL,1,sizeof(struct symbol));//申请内存块并清零
         MemoryCheck(sp); //检查内存申请是否成功
         sp->name=Strsafe(x); // 设置符号的名称
         sp->type=ISUPPER(*x)?TERMINAL:NONTERMINAL;//按照lemon要求,首字母大写为终结符,小写为非终结符
@@ -1272,6 +1729,133 @@ struct symbol *Symbol_find(const char *key){
 }
 
 
+/**
+ * @brief 返回符号表里第n个(n从0开始,按插入顺序)符号
+ * @param n 符号在x2a->tbl[]里的下标
+ * @return 符号指针,n超出范围返回空指针
+ */
+struct symbol *Symbol_Nth(int n){
+    if (x2a && n>=0 && n<x2a->count) return x2a->tbl[n].data;
+    return 0;
+}
+
+/**
+ * @brief 返回符号表里符号的数量
+ * @return 符号数量
+ */
+int Symbol_count(void){
+    return x2a?x2a->count:0;
+}
+
+/**
+ * @brief 把符号表里所有符号按插入顺序拷贝到一个新申请的指针数组里,数组由调用者负责释放
+ * @return 符号指针数组,长度为Symbol_count()
+ */
+struct symbol **Symbol_arrayof(void){
+    struct symbol **array;
+    int i,arrSize;
+    if (x2a==0) return 0;
+    arrSize=x2a->count;
+    array=(struct symbol**)lemon_calloc(MEM_SYMBOL,arrSize?arrSize:1, sizeof(struct symbol*));
+    if (array){
+        for (i=0;i<arrSize;i++) array[i]=x2a->tbl[i].data;
+    }
+    return array;
+}
+
+/**
+ * @brief 符号排序时的类别:终结符为0,非终结符为1,MULTITERMINAL为2
+ * @see 与lemon的约定一致,名称首字母大于'Z'(小写字母以及"{default}")的就当作非终结符,
+ * 其余(大写字母以及"$")都是终结符.
+ */
+#define SYMBOL_CLASS(sp) ((sp)->type==MULTITERMINAL?2:((sp)->name[0]>'Z'?1:0))
+
+/**
+ * @brief 用于qsort()的符号比较函数:先按类别(终结符、非终结符、MULTITERMINAL),同一类别再按名称排序
+ * @see Symbol_sort()得到的顺序与用这个函数qsort()的结果完全相同
+ * @param _a 指向第一个符号指针的指针
+ * @param _b 指向第二个符号指针的指针
+ * @return 小于0、等于0、大于0分别表示a排在b前面、相同、后面
+ */
+int Symbolcmpp(const void *_a,const void *_b){
+    const struct symbol *a=*(const struct symbol**)_a;
+    const struct symbol *b=*(const struct symbol**)_b;
+    int i1=SYMBOL_CLASS(a);
+    int i2=SYMBOL_CLASS(b);
+    return i1==i2?strcmp(a->name,b->name):i1-i2;
+}
+
+#define SYMBOL_SORT_CUTOFF 16 ///< 基数排序时小于这个数量的桶直接改用插入排序
+
+/**
+ * @brief 对名称的前d个字符都相同的符号数组a[]做MSD基数排序(从第d个字符开始比较)
+ * @see 每一轮按第d个字符计数分桶(字符串结束的'\0'单独作为最小的0号桶),
+ * 分桶结果先写到tmp[]再拷回a[],然后对每个非0号桶递归处理第d+1个字符.
+ * 0号桶里的名称已经完全相同,不需要再排.整个过程只比较单个字节,不调用strcmp()和比较函数指针.
+ * @param a   待排序的符号数组
+ * @param tmp 与a[]长度相同的临时数组
+ * @param n   符号数量
+ * @param d   当前比较的字符位置
+ */
+static void symbol_radix_sort(struct symbol **a,struct symbol **tmp,int n,int d){
+    int count[257];
+    int i,c;
+    if (n<SYMBOL_SORT_CUTOFF){ // 桶很小时插入排序更快
+        for (i=1;i<n;i++){
+            struct symbol *sp=a[i];
+            int j=i;
+            while (j>0 && strcmp(a[j-1]->name+d,sp->name+d)>0){
+                a[j]=a[j-1];
+                j--;
+            }
+            a[j]=sp;
+        }
+        return;
+    }
+    memset(count,0, sizeof(count));
+    for (i=0;i<n;i++) count[(unsigned char)a[i]->name[d]+1]++;
+    for (c=1;c<257;c++) count[c]+=count[c-1]; // count[c]变成第c号桶的起始位置
+    for (i=0;i<n;i++) tmp[count[(unsigned char)a[i]->name[d]]++]=a[i];
+    memcpy(a,tmp, sizeof(a[0])*n);
+    // 分桶后count[c]是第c号桶的结束位置,也就是第c+1号桶的起始位置
+    for (c=1;c<256;c++){
+        if (count[c]-count[c-1]>1){
+            symbol_radix_sort(&a[count[c-1]],tmp,count[c]-count[c-1],d+1);
+        }
+    }
+}
+
+/**
+ * @brief 把符号数组按Symbolcmpp()规定的顺序排序,并给每个符号的index赋值为排序后的位置.
+ * @see 先用计数排序按类别(终结符、非终结符、MULTITERMINAL)稳定地分成三段,
+ * 再对每一段用symbol_radix_sort()按名称排序,最后一遍循环设置index.
+ * 对于大量符号,这比qsort()每次比较都经过函数指针调用Symbolcmpp()再调用strcmp()快得多.
+ * @param a 符号指针数组(一般是Symbol_arrayof()的返回值)
+ * @param n 符号数量
+ */
+void Symbol_sort(struct symbol **a,int n){
+    struct symbol **tmp;
+    int start[4]={0,0,0,0}; // start[k]为第k类符号的起始位置,start[3]==n
+    int i,k;
+    if (n<=0) return;
+    tmp=(struct symbol**)lemon_malloc(MEM_SYMBOL,sizeof(tmp[0])*n);
+    MemoryCheck(tmp);
+    for (i=0;i<n;i++) start[SYMBOL_CLASS(a[i])+1]++;
+    for (k=1;k<4;k++) start[k]+=start[k-1];
+    {
+        int pos[3];
+        for (k=0;k<3;k++) pos[k]=start[k];
+        for (i=0;i<n;i++) tmp[pos[SYMBOL_CLASS(a[i])]++]=a[i];
+    }
+    memcpy(a,tmp, sizeof(a[0])*n);
+    for (k=0;k<3;k++){
+        symbol_radix_sort(&a[start[k]],tmp,start[k+1]-start[k],0);
+    }
+    lemon_free(tmp);
+    for (i=0;i<n;i++) a[i]->index=i;
+}
+
+
 /// \brief 类似于s_x1与s_x2的结构
 struct s_x3{
     int size;
@@ -1294,13 +1878,13 @@ static struct s_x3*x3a; ///< 全局唯一的s_x3实例
  */
 void State_init(void){
     if (x3a) return;
-    x3a=(struct s_x3*)malloc(sizeof(struct s_x3));
+    x3a=(struct s_x3*)lemon_malloc(MEM_STATE,sizeof(struct s_x3));
     if (x3a){
         x3a->size=128;
         x3a->count=0;
-        x3a->tbl=(x3node*)calloc(128, sizeof(x3node)+ sizeof(x3node*));
+        x3a->tbl=(x3node*)lemon_calloc(MEM_STATE,128, sizeof(x3node)+ sizeof(x3node*));
         if (x3a->tbl==0){
-            free(x3a);
+            lemon_free(x3a);
             x3a=0;
         } else{
             int i;